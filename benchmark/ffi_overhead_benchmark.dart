@@ -0,0 +1,168 @@
+// FFI overhead benchmark for AiliaLLMModel.
+//
+// Measures ns/call and native allocations/call of the wrapper methods.
+// See benchmark/README.md for how to run it against the real library
+// and against the stub library.
+
+import 'dart:ffi';
+import 'dart:io';
+
+import 'package:ailia_llm/ailia_llm_model.dart';
+
+typedef AllocCountNative = Uint64 Function();
+typedef AllocCountDart = int Function();
+
+class _AllocCounter {
+  AllocCountDart? _count;
+
+  _AllocCounter() {
+    try {
+      _count = DynamicLibrary.process()
+          .lookupFunction<AllocCountNative, AllocCountDart>(
+              'ailiaBenchAllocCount');
+    } on ArgumentError {
+      _count = null;
+    }
+  }
+
+  bool get available => _count != null;
+
+  int read() {
+    return _count == null ? 0 : _count!();
+  }
+}
+
+class _Result {
+  final String name;
+  final int calls;
+  final int elapsedNs;
+  final int allocs;
+
+  _Result(this.name, this.calls, this.elapsedNs, this.allocs);
+
+  String format(bool allocAvailable) {
+    String nsPerCall = (elapsedNs / calls).toStringAsFixed(1);
+    String allocPerCall =
+        allocAvailable ? (allocs / calls).toStringAsFixed(2) : "n/a";
+    return "${name.padRight(16)} ${calls.toString().padLeft(8)} calls"
+        " ${nsPerCall.padLeft(12)} ns/call ${allocPerCall.padLeft(8)} allocs/call";
+  }
+}
+
+_Result _measure(String name, int iterations, _AllocCounter counter,
+    void Function() body, {bool warmUp = true}) {
+  // Warm up JIT and lazy FFI lookups before measuring.
+  for (int i = 0; warmUp && i < iterations ~/ 10 + 1; i++) {
+    body();
+  }
+  final stopwatch = Stopwatch();
+  int allocBefore = counter.read();
+  stopwatch.start();
+  for (int i = 0; i < iterations; i++) {
+    body();
+  }
+  stopwatch.stop();
+  int allocs = counter.read() - allocBefore;
+  int elapsedNs =
+      (stopwatch.elapsedTicks * (1000000000 / stopwatch.frequency)).round();
+  return _Result(name, iterations, elapsedNs, allocs);
+}
+
+List<Map<String, dynamic>> _makeMessages(int turns) {
+  List<Map<String, dynamic>> messages =
+      List<Map<String, dynamic>>.empty(growable: true);
+  messages.add({"role": "system", "content": "You are a helpful assistant."});
+  for (int i = 0; i < turns; i++) {
+    messages.add({"role": "user", "content": "Question number $i ?"});
+    messages.add({"role": "assistant", "content": "Answer number $i ."});
+  }
+  messages.add({"role": "user", "content": "Last question ?"});
+  return messages;
+}
+
+void main(List<String> args) {
+  String modelPath = "stub.gguf";
+  int iterations = 10000;
+  int nCtx = 4096;
+  int turns = 16;
+  for (int i = 0; i + 1 < args.length; i += 2) {
+    switch (args[i]) {
+      case "--model":
+        modelPath = args[i + 1];
+        break;
+      case "--iterations":
+        iterations = int.parse(args[i + 1]);
+        break;
+      case "--n-ctx":
+        nCtx = int.parse(args[i + 1]);
+        break;
+      case "--turns":
+        turns = int.parse(args[i + 1]);
+        break;
+      default:
+        stderr.writeln("unknown option ${args[i]}");
+        exit(1);
+    }
+  }
+
+  final counter = _AllocCounter();
+  final results = List<_Result>.empty(growable: true);
+
+  // getBackendList caches its result, so only the first call probes the
+  // libraries. It is measured alone, before the cache hits.
+  results.add(_measure("getBackendList*", 1, counter, () {
+    AiliaLLMModel.getBackendList();
+  }, warmUp: false));
+
+  results.add(_measure("getBackendList", iterations, counter, () {
+    AiliaLLMModel.getBackendList();
+  }));
+
+  final model = AiliaLLMModel();
+  model.open(modelPath, nCtx);
+
+  final messages = _makeMessages(turns);
+  results.add(_measure("setPrompt", iterations ~/ 10 + 1, counter, () {
+    model.setPrompt(messages);
+  }));
+
+  model.setPrompt(messages);
+  results.add(_measure("generate", iterations, counter, () {
+    if (model.generate() == null) {
+      model.setPrompt(messages);
+    }
+  }));
+
+  model.setPrompt(messages);
+  results.add(_measure("generateN(16)", iterations ~/ 16 + 1, counter, () {
+    if (model.generateN(16).done) {
+      model.setPrompt(messages);
+    }
+  }));
+
+  // getTokenCount caches its results per text, so a repeated text only
+  // measures the cache and a new text measures the library call.
+  results.add(_measure("getTokenCount", iterations, counter, () {
+    model.getTokenCount("The quick brown fox jumps over the lazy dog.");
+  }));
+
+  int textIndex = 0;
+  results.add(_measure("getTokenCount*", iterations, counter, () {
+    model.getTokenCount("The quick brown fox jumps over the lazy dog "
+        "${textIndex++}.");
+  }));
+
+  model.close();
+
+  stdout.writeln("model: $modelPath, n_ctx: $nCtx, turns: $turns");
+  stdout.writeln("getBackendList* is the first call, getBackendList a "
+      "cache hit");
+  stdout.writeln("getTokenCount is a cached text, getTokenCount* a new "
+      "text on every call");
+  if (!counter.available) {
+    stdout.writeln("allocation counter not preloaded, allocs/call is n/a");
+  }
+  for (final result in results) {
+    stdout.writeln(result.format(counter.available));
+  }
+}
@@ -0,0 +1,167 @@
+/*
+ * Stub implementation of ailia_llm.h used by the FFI overhead benchmark.
+ * It performs no inference, so timings measured against it are the cost
+ * of the Dart wrapper and the FFI transitions only.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../native/ailia_llm.h"
+
+#define STUB_DELTA_TEXT "token"
+
+struct AILIALLM {
+    unsigned int n_ctx;
+    unsigned int prompt_tokens;
+    unsigned int generated_tokens;
+    unsigned int max_tokens;
+};
+
+AILIA_LLM_API int ailiaLLMGetBackendCount(unsigned int* env_count)
+{
+    if (env_count == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *env_count = 1;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetBackendName(const char** env, unsigned int env_idx)
+{
+    if (env == NULL || env_idx != 0) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *env = "CPU";
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMCreate(struct AILIALLM** llm)
+{
+    if (llm == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *llm = (struct AILIALLM*)calloc(1, sizeof(struct AILIALLM));
+    if (*llm == NULL) {
+        return AILIA_LLM_STATUS_MEMORY_INSUFFICIENT;
+    }
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMOpenModelFileA(struct AILIALLM* llm, const char *path, unsigned int n_ctx)
+{
+    if (llm == NULL || path == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    llm->n_ctx = n_ctx == 0 ? 4096 : n_ctx;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMOpenModelFileW(struct AILIALLM* llm, const wchar_t *path, unsigned int n_ctx)
+{
+    if (llm == NULL || path == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    llm->n_ctx = n_ctx == 0 ? 4096 : n_ctx;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetContextSize(struct AILIALLM* llm, unsigned int *context_size)
+{
+    if (llm == NULL || context_size == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *context_size = llm->n_ctx;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMSetSamplingParams(struct AILIALLM* llm, unsigned int top_k, float top_p, float temp, unsigned int dist)
+{
+    if (llm == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMSetPrompt(struct AILIALLM* llm, const AILIALLMChatMessage * message, unsigned int message_cnt)
+{
+    unsigned int i;
+    size_t bytes = 0;
+    if (llm == NULL || message == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    for (i = 0; i < message_cnt; i++) {
+        bytes += strlen(message[i].role) + strlen(message[i].content);
+    }
+    llm->prompt_tokens = (unsigned int)(bytes / 4);
+    llm->generated_tokens = 0;
+    llm->max_tokens = llm->n_ctx > llm->prompt_tokens ? llm->n_ctx - llm->prompt_tokens : 0;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGenerate(struct AILIALLM* llm, unsigned int *done)
+{
+    if (llm == NULL || done == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    if (llm->generated_tokens >= llm->max_tokens) {
+        *done = 1;
+        return AILIA_LLM_STATUS_SUCCESS;
+    }
+    llm->generated_tokens++;
+    *done = 0;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetDeltaTextSize(struct AILIALLM* llm, unsigned int *buf_size)
+{
+    if (llm == NULL || buf_size == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *buf_size = (unsigned int)sizeof(STUB_DELTA_TEXT);
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetDeltaText(struct AILIALLM* llm, char * text, unsigned int buf_size)
+{
+    if (llm == NULL || text == NULL || buf_size < sizeof(STUB_DELTA_TEXT)) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    if (llm->generated_tokens == 0) {
+        return AILIA_LLM_STATUS_INVALID_STATE;
+    }
+    memcpy(text, STUB_DELTA_TEXT, sizeof(STUB_DELTA_TEXT));
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetTokenCount(struct AILIALLM* llm, unsigned int *cnt, const char* text)
+{
+    if (llm == NULL || cnt == NULL || text == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *cnt = (unsigned int)(strlen(text) / 4);
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetPromptTokenCount(struct AILIALLM* llm, unsigned int *cnt)
+{
+    if (llm == NULL || cnt == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *cnt = llm->prompt_tokens;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API int ailiaLLMGetGeneratedTokenCount(struct AILIALLM* llm, unsigned int *cnt)
+{
+    if (llm == NULL || cnt == NULL) {
+        return AILIA_LLM_STATUS_INVALID_ARGUMENT;
+    }
+    *cnt = llm->generated_tokens;
+    return AILIA_LLM_STATUS_SUCCESS;
+}
+
+AILIA_LLM_API void ailiaLLMDestroy(struct AILIALLM* llm)
+{
+    free(llm);
+}
@@ -0,0 +1,65 @@
+/*
+ * malloc/calloc counter preloaded into the benchmark process.
+ * package:ffi resolves malloc and calloc from the process, so the counter
+ * observes every native allocation made by AiliaLLMModel.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stddef.h>
+
+static void* (*real_malloc)(size_t) = NULL;
+static void* (*real_calloc)(size_t, size_t) = NULL;
+static void (*real_free)(void*) = NULL;
+static unsigned long long alloc_count = 0;
+
+/* dlsym itself may call calloc before real_calloc is resolved. */
+static char bootstrap_buffer[4096];
+static size_t bootstrap_used = 0;
+
+void* malloc(size_t size)
+{
+    if (real_malloc == NULL) {
+        real_malloc = (void* (*)(size_t))dlsym(RTLD_NEXT, "malloc");
+    }
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return real_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    if (real_calloc == NULL) {
+        static int resolving = 0;
+        if (resolving) {
+            size_t bytes = (nmemb * size + 15) & ~(size_t)15;
+            void* p;
+            if (bootstrap_used + bytes > sizeof(bootstrap_buffer)) {
+                return NULL;
+            }
+            p = bootstrap_buffer + bootstrap_used;
+            bootstrap_used += bytes;
+            return p;
+        }
+        resolving = 1;
+        real_calloc = (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+        resolving = 0;
+    }
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return real_calloc(nmemb, size);
+}
+
+void free(void* ptr)
+{
+    if ((char*)ptr >= bootstrap_buffer && (char*)ptr < bootstrap_buffer + sizeof(bootstrap_buffer)) {
+        return;
+    }
+    if (real_free == NULL) {
+        real_free = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+    }
+    real_free(ptr);
+}
+
+unsigned long long ailiaBenchAllocCount(void)
+{
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
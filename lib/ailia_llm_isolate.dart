@@ -0,0 +1,460 @@
+import 'dart:async';
+import 'dart:convert';
+import 'dart:isolate';
+import 'dart:math';
+import 'dart:typed_data';
+
+import 'ailia_llm_model.dart';
+
+const String _CMD_OPEN = "open";
+const String _CMD_WARMUP = "warmup";
+const String _CMD_SAMPLING = "sampling";
+const String _CMD_PROMPT = "prompt";
+const String _CMD_CANCEL = "cancel";
+const String _CMD_ACK = "ack";
+const String _CMD_CLOSE = "close";
+
+const String _RES_RESULT = "result";
+const String _RES_PROGRESS = "progress";
+const String _RES_TOKENS = "tokens";
+const String _RES_DONE = "done";
+const String _RES_ERROR = "error";
+
+/// Run AiliaLLMModel in a dedicated background isolate.
+/// The model and its DynamicLibrary are owned by the isolate, so decoding
+/// never blocks the calling (UI) isolate. The raw UTF-8 bytes of the
+/// generated tokens are packed into a reused batch buffer, copied once into
+/// a TransferableTypedData and materialized without a copy by the caller,
+/// which decodes them incrementally.
+class AiliaLLMIsolate {
+  Isolate? _isolate;
+  Future<void>? _spawning;
+  SendPort? _sendPort;
+  ReceivePort? _receivePort;
+  ReceivePort? _exitPort;
+  int _requestId = 0;
+  final Map<int, Completer<void>> _pending = {};
+  final Map<int, StreamController<String>> _streams = {};
+  final Map<int, ByteConversionSink> _decoders = {};
+  final Map<int, int> _unacked = {};
+  final Map<int, void Function(int loaded, int total)> _progress = {};
+  // Ids of the open calls in progress, which cancel() aborts.
+  final Set<int> _opening = {};
+  bool _contextFull = false;
+
+  /// Number of token batches the isolate may send before the consumer
+  /// has received them. Generation is suspended when the limit is reached.
+  final int maxInFlightBatches;
+
+  /// Maximum number of tokens packed into a single batch.
+  final int maxBatchTokens;
+
+  AiliaLLMIsolate({this.maxInFlightBatches = 4, this.maxBatchTokens = 8});
+
+  // Concurrent callers share the same spawn.
+  Future<void> _spawn() {
+    _spawning ??= _doSpawn();
+    return _spawning!;
+  }
+
+  Future<void> _doSpawn() async {
+    final receivePort = ReceivePort();
+    final exitPort = ReceivePort();
+    final ready = Completer<SendPort>();
+    receivePort.listen((message) {
+      if (message is SendPort) {
+        ready.complete(message);
+        return;
+      }
+      _onMessage(message as List<dynamic>);
+    });
+    // Uncaught errors are fatal to the isolate, so both end up in _onExit.
+    exitPort.listen((message) {
+      if (!ready.isCompleted) {
+        ready.completeError(Exception("ailiaLLM isolate exited"));
+      }
+      _onExit(message);
+    });
+    _receivePort = receivePort;
+    _exitPort = exitPort;
+    try {
+      _isolate = await Isolate.spawn(_isolateMain,
+          [receivePort.sendPort, maxInFlightBatches, maxBatchTokens],
+          onExit: exitPort.sendPort, onError: exitPort.sendPort);
+      _sendPort = await ready.future;
+    } catch (e) {
+      _reset();
+      rethrow;
+    }
+  }
+
+  // Fail all the work in progress when the isolate dies.
+  void _onExit(dynamic message) {
+    final error = Exception(message is List
+        ? "ailiaLLM isolate error ${message[0]}"
+        : "ailiaLLM isolate exited");
+    _reset();
+    for (final completer in _pending.values) {
+      completer.completeError(error);
+    }
+    _pending.clear();
+    _progress.clear();
+    _opening.clear();
+    _closeStreams(error);
+  }
+
+  // Fail the streams which are not finished, including those never
+  // listened to.
+  void _closeStreams(Exception error) {
+    _unacked.clear();
+    _decoders.clear();
+    for (final controller in _streams.values) {
+      controller.addError(error);
+      controller.close();
+    }
+    _streams.clear();
+  }
+
+  void _reset() {
+    _receivePort?.close();
+    _exitPort?.close();
+    _isolate = null;
+    _spawning = null;
+    _sendPort = null;
+    _receivePort = null;
+    _exitPort = null;
+  }
+
+  void _onMessage(List<dynamic> message) {
+    final String type = message[0];
+    final int id = message[1];
+    switch (type) {
+      case _RES_RESULT:
+        _progress.remove(id);
+        _opening.remove(id);
+        _pending.remove(id)?.complete();
+        break;
+      case _RES_PROGRESS:
+        _progress[id]?.call(message[2], message[3]);
+        break;
+      case _RES_TOKENS:
+        final controller = _streams[id];
+        if (controller == null) {
+          break;
+        }
+        final bytes = (message[2] as TransferableTypedData)
+            .materialize()
+            .asUint8List();
+        // A batch may end in the middle of a multi-byte character.
+        _decoders[id]!.add(bytes);
+        if (controller.isPaused) {
+          _unacked[id] = (_unacked[id] ?? 0) + 1;
+        } else {
+          _sendPort!.send([_CMD_ACK, id, 1]);
+        }
+        break;
+      case _RES_DONE:
+        _contextFull = message[2];
+        _unacked.remove(id);
+        _streams.remove(id);
+        // Closing the decoder flushes it and closes the stream.
+        _decoders.remove(id)?.close();
+        break;
+      case _RES_ERROR:
+        final error = Exception(message[2]);
+        _progress.remove(id);
+        _opening.remove(id);
+        final completer = _pending.remove(id);
+        if (completer != null) {
+          completer.completeError(error);
+        }
+        _unacked.remove(id);
+        _decoders.remove(id);
+        final controller = _streams.remove(id);
+        if (controller != null) {
+          controller.addError(error);
+          controller.close();
+        }
+        break;
+    }
+  }
+
+  Future<void> _call(List<dynamic> command) {
+    final completer = Completer<void>();
+    _pending[command[1]] = completer;
+    _sendPort!.send(command);
+    return completer.future;
+  }
+
+  /// Spawn the isolate if needed and open the model inside it.
+  /// When preloadFile is true, the model file is first read into the OS
+  /// page cache with parallel reads, reporting the progress in bytes
+  /// through onProgress. cancel() aborts an open which is still queued or
+  /// preloading.
+  Future<void> open(String modelPath, int nCtx,
+      {String backend = "",
+      bool preloadFile = false,
+      void Function(int loaded, int total)? onProgress}) async {
+    await _spawn();
+    final int id = ++_requestId;
+    _opening.add(id);
+    if (onProgress != null) {
+      _progress[id] = onProgress;
+    }
+    await _call([_CMD_OPEN, id, modelPath, nCtx, backend, preloadFile]);
+  }
+
+  /// Run AiliaLLMModel.warmup inside the isolate.
+  Future<void> warmup({bool preloadFile = true}) async {
+    if (_sendPort == null) {
+      throw Exception("ailia LLM not initialized.");
+    }
+    await _call([_CMD_WARMUP, ++_requestId, preloadFile]);
+  }
+
+  Future<void> setSamplingParams(int top_k, double top_p, double temp, int dist,
+      {bool reseedEachPrompt = false}) async {
+    if (_sendPort == null) {
+      throw Exception("ailia LLM not initialized.");
+    }
+    await _call([
+      _CMD_SAMPLING,
+      ++_requestId,
+      top_k,
+      top_p,
+      temp,
+      dist,
+      reseedEachPrompt
+    ]);
+  }
+
+  /// Set the prompt and stream the generated text.
+  /// Each event contains one or more tokens. Pausing the subscription
+  /// suspends generation once maxInFlightBatches batches are pending.
+  /// seed is passed to AiliaLLMModel.setPrompt.
+  Stream<String> generate(List<Map<String, dynamic>> messages, {int? seed}) {
+    if (_sendPort == null) {
+      throw Exception("ailia LLM not initialized.");
+    }
+    final int id = ++_requestId;
+    late final StreamController<String> controller;
+    controller = StreamController<String>(
+      onListen: () {
+        _sendPort!.send([_CMD_PROMPT, id, messages, seed]);
+      },
+      onResume: () {
+        final int count = _unacked.remove(id) ?? 0;
+        if (count > 0) {
+          _sendPort?.send([_CMD_ACK, id, count]);
+        }
+      },
+      onCancel: () {
+        _decoders.remove(id);
+        if (_streams.remove(id) != null) {
+          _sendPort?.send([_CMD_CANCEL, id]);
+        }
+      },
+    );
+    _streams[id] = controller;
+    _decoders[id] = const Utf8Decoder(allowMalformed: true)
+        .startChunkedConversion(controller.sink);
+    return controller.stream;
+  }
+
+  /// Stop the generation in progress. The stream is closed after the
+  /// batch currently being decoded.
+  void cancel() {
+    for (final id in _streams.keys) {
+      _sendPort?.send([_CMD_CANCEL, id]);
+    }
+    for (final id in _opening) {
+      _sendPort?.send([_CMD_CANCEL, id]);
+    }
+  }
+
+  bool contextFull() {
+    return _contextFull;
+  }
+
+  /// Close the model and terminate the isolate.
+  Future<void> close() async {
+    if (_sendPort == null) {
+      return;
+    }
+    cancel();
+    await _call([_CMD_CLOSE, ++_requestId]);
+    final isolate = _isolate;
+    _reset();
+    isolate?.kill();
+    _closeStreams(Exception("ailiaLLM isolate closed"));
+  }
+}
+
+class _IsolateState {
+  final SendPort sendPort;
+  final int maxInFlightBatches;
+  final int maxBatchTokens;
+  final AiliaLLMModel model = AiliaLLMModel();
+  int activeId = -1;
+  bool cancelled = false;
+  // Commands received and not finished yet, and those of them cancelled
+  // before they started. Cancels of finished commands are ignored.
+  final Set<int> queuedIds = {};
+  final Set<int> cancelledIds = {};
+  int credits = 0;
+  Completer<void>? creditAvailable;
+
+  // Batch buffer reused across batches and prompts.
+  Uint8List batch = Uint8List(4096);
+
+  _IsolateState(this.sendPort, this.maxInFlightBatches, this.maxBatchTokens);
+
+  void onAck(int id, int count) {
+    if (id != activeId) {
+      return;
+    }
+    credits += count;
+    creditAvailable?.complete();
+    creditAvailable = null;
+  }
+
+  void onCancel(int id) {
+    if (id != activeId) {
+      // The command may still be waiting in the queue.
+      if (queuedIds.contains(id)) {
+        cancelledIds.add(id);
+      }
+      return;
+    }
+    cancelled = true;
+    creditAvailable?.complete();
+    creditAvailable = null;
+  }
+
+  Future<void> generate(
+      int id, List<Map<String, dynamic>> messages, int? seed) async {
+    activeId = id;
+    cancelled = cancelledIds.remove(id);
+    credits = maxInFlightBatches;
+    try {
+      model.setPrompt(messages, seed: seed);
+      if (model.contextFull()) {
+        sendPort.send([_RES_DONE, id, true]);
+        return;
+      }
+      bool done = false;
+      while (!done && !cancelled) {
+        int length = 0;
+        for (int tokens = 0; tokens < maxBatchTokens; tokens++) {
+          final Uint8List? bytes = model.generateBytes();
+          if (bytes == null) {
+            done = true;
+            break;
+          }
+          if (length + bytes.length > batch.length) {
+            final grown =
+                Uint8List(max(batch.length * 2, length + bytes.length));
+            grown.setRange(0, length, batch);
+            batch = grown;
+          }
+          batch.setRange(length, length + bytes.length, bytes);
+          length += bytes.length;
+        }
+        if (length > 0) {
+          while (credits == 0 && !cancelled) {
+            creditAvailable = Completer<void>();
+            await creditAvailable!.future;
+          }
+          if (cancelled) {
+            break;
+          }
+          credits--;
+          sendPort.send([
+            _RES_TOKENS,
+            id,
+            TransferableTypedData.fromList(
+                [Uint8List.sublistView(batch, 0, length)])
+          ]);
+        }
+        // Let cancel and ack commands in between batches.
+        await Future<void>.delayed(Duration.zero);
+      }
+      sendPort.send([_RES_DONE, id, model.contextFull()]);
+    } catch (e) {
+      sendPort.send([_RES_ERROR, id, e.toString()]);
+    } finally {
+      activeId = -1;
+    }
+  }
+}
+
+void _isolateMain(List<dynamic> args) {
+  final receivePort = ReceivePort();
+  final state = _IsolateState(args[0], args[1], args[2]);
+  state.sendPort.send(receivePort.sendPort);
+
+  // Commands other than ack and cancel are serialized so that a prompt
+  // is never set while another generation is in progress.
+  Future<void> queue = Future<void>.value();
+
+  receivePort.listen((message) {
+    final List<dynamic> command = message;
+    final String type = command[0];
+    final int id = command[1];
+    if (type == _CMD_ACK) {
+      state.onAck(id, command[2]);
+      return;
+    }
+    if (type == _CMD_CANCEL) {
+      state.onCancel(id);
+      return;
+    }
+    state.queuedIds.add(id);
+    queue = queue.then((_) async {
+      try {
+        switch (type) {
+          case _CMD_OPEN:
+            if (AiliaLLMModel.getBackendList().isEmpty) {
+              throw Exception("ailiaLLM backend not found");
+            }
+            if (command[5]) {
+              await AiliaLLMModel.preloadModelFileAsync(command[2],
+                  progress: (int loaded, int total) {
+                state.sendPort.send([_RES_PROGRESS, id, loaded, total]);
+              }, cancelled: () {
+                return state.cancelledIds.contains(id);
+              });
+            }
+            if (state.cancelledIds.remove(id)) {
+              throw Exception("ailiaLLM open cancelled");
+            }
+            state.model.open(command[2], command[3], backend: command[4]);
+            break;
+          case _CMD_WARMUP:
+            state.model.warmup(preloadFile: command[2]);
+            break;
+          case _CMD_SAMPLING:
+            state.model.setSamplingParams(
+                command[2], command[3], command[4], command[5],
+                reseedEachPrompt: command[6]);
+            break;
+          case _CMD_PROMPT:
+            await state.generate(id,
+                (command[2] as List).cast<Map<String, dynamic>>(), command[3]);
+            break;
+          case _CMD_CLOSE:
+            state.model.close();
+            break;
+        }
+        if (type != _CMD_PROMPT) {
+          state.sendPort.send([_RES_RESULT, id]);
+        }
+      } catch (e) {
+        state.sendPort.send([_RES_ERROR, id, e.toString()]);
+      } finally {
+        state.queuedIds.remove(id);
+        state.cancelledIds.remove(id);
+      }
+    });
+  });
+}
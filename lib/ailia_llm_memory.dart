@@ -0,0 +1,287 @@
+import 'dart:convert';
+import 'dart:io';
+import 'dart:math';
+import 'dart:typed_data';
+
+const int _GGUF_MAGIC = 0x46554747; // "GGUF"
+
+const int _GGUF_TYPE_UINT8 = 0;
+const int _GGUF_TYPE_INT8 = 1;
+const int _GGUF_TYPE_UINT16 = 2;
+const int _GGUF_TYPE_INT16 = 3;
+const int _GGUF_TYPE_UINT32 = 4;
+const int _GGUF_TYPE_INT32 = 5;
+const int _GGUF_TYPE_FLOAT32 = 6;
+const int _GGUF_TYPE_BOOL = 7;
+const int _GGUF_TYPE_STRING = 8;
+const int _GGUF_TYPE_ARRAY = 9;
+const int _GGUF_TYPE_UINT64 = 10;
+const int _GGUF_TYPE_INT64 = 11;
+const int _GGUF_TYPE_FLOAT64 = 12;
+
+// Number of tokens processed per compute step, used for the compute buffer.
+const int _N_UBATCH = 512;
+
+// Bytes per element of the KV cache (f16).
+const int _KV_ELEMENT_SIZE = 2;
+
+/// Memory estimate of a model, in bytes.
+class AiliaLLMMemoryEstimate {
+  /// Model weights.
+  final int weights;
+
+  /// KV cache for nCtx tokens.
+  final int kvCache;
+
+  /// Compute buffers (logits and attention scores of one batch).
+  final int compute;
+
+  /// Context length used for the estimate.
+  final int nCtx;
+
+  /// Context length the model was trained with.
+  final int trainedContextLength;
+
+  AiliaLLMMemoryEstimate(this.weights, this.kvCache, this.compute, this.nCtx,
+      this.trainedContextLength);
+
+  int get total => weights + kvCache + compute;
+}
+
+// Model parameters read from the GGUF header.
+class AiliaLLMModelInfo {
+  final int fileSize;
+  final int contextLength;
+  final int nVocab;
+  final int nHead;
+  // Sum over the layers of n_head_kv * (key_length + value_length).
+  final int kvElementsPerToken;
+
+  AiliaLLMModelInfo(this.fileSize, this.contextLength, this.nVocab, this.nHead,
+      this.kvElementsPerToken);
+
+  static AiliaLLMModelInfo read(String modelPath) {
+    final reader = _GGUFReader(File(modelPath).openSync());
+    try {
+      return reader.readInfo();
+    } finally {
+      reader.close();
+    }
+  }
+
+  /// Estimate the memory used with a context of nCtx tokens
+  /// (0 is the model default).
+  AiliaLLMMemoryEstimate estimate(int nCtx) {
+    if (nCtx == 0) {
+      nCtx = contextLength;
+    }
+    final int kvCache = kvElementsPerToken * _KV_ELEMENT_SIZE * nCtx;
+    return AiliaLLMMemoryEstimate(
+        fileSize, kvCache, _computeSize(nCtx), nCtx, contextLength);
+  }
+
+  /// Largest context length, at most nCtx (0 is the model default), whose
+  /// estimate fits in budget bytes. A reduced length is rounded down to a
+  /// multiple of 256 tokens when it is at least 256. Returns 0 when even a
+  /// single token does not fit.
+  int fitContextLength(int nCtx, int budget) {
+    if (nCtx == 0) {
+      nCtx = contextLength;
+    }
+    const int step = 256;
+    int low = 0;
+    int high = nCtx;
+    while (low < high) {
+      final int mid = (low + high + 1) ~/ 2;
+      if (estimate(mid).total <= budget) {
+        low = mid;
+      } else {
+        high = mid - 1;
+      }
+    }
+    if (low < nCtx && low >= step) {
+      low = low ~/ step * step;
+    }
+    return low;
+  }
+
+  int _computeSize(int nCtx) {
+    final int batch = min(nCtx, _N_UBATCH);
+    final int logits = nVocab * batch * 4;
+    final int attention = nHead * nCtx * batch * 4;
+    return logits + attention;
+  }
+}
+
+class _GGUFReader {
+  final RandomAccessFile _file;
+  final Uint8List _buffer = Uint8List(64 * 1024);
+  late final ByteData _data = ByteData.sublistView(_buffer);
+  int _position = 0;
+  int _length = 0;
+
+  _GGUFReader(this._file);
+
+  void close() {
+    _file.closeSync();
+  }
+
+  void _fill(int size) {
+    if (_length - _position >= size) {
+      return;
+    }
+    final int remaining = _length - _position;
+    _buffer.setRange(0, remaining, _buffer, _position);
+    _length = remaining + _file.readIntoSync(_buffer, remaining);
+    _position = 0;
+    if (_length < size) {
+      throw Exception("GGUF header is truncated");
+    }
+  }
+
+  int _u32() {
+    _fill(4);
+    final int value = _data.getUint32(_position, Endian.little);
+    _position += 4;
+    return value;
+  }
+
+  int _u64() {
+    _fill(8);
+    final int value = _data.getUint64(_position, Endian.little);
+    _position += 8;
+    return value;
+  }
+
+  void _skip(int size) {
+    while (size > 0) {
+      final int chunk = min(size, _buffer.length);
+      _fill(chunk);
+      _position += chunk;
+      size -= chunk;
+    }
+  }
+
+  String _string() {
+    final int size = _u64();
+    if (size > _buffer.length) {
+      _skip(size);
+      return "";
+    }
+    _fill(size);
+    final String value =
+        utf8.decode(_buffer.sublist(_position, _position + size),
+            allowMalformed: true);
+    _position += size;
+    return value;
+  }
+
+  // Read a scalar value as int, or skip it and return null.
+  int? _scalar(int type) {
+    switch (type) {
+      case _GGUF_TYPE_UINT8:
+      case _GGUF_TYPE_INT8:
+      case _GGUF_TYPE_BOOL:
+        _fill(1);
+        return _buffer[_position++];
+      case _GGUF_TYPE_UINT16:
+      case _GGUF_TYPE_INT16:
+        _fill(2);
+        final int value = _data.getUint16(_position, Endian.little);
+        _position += 2;
+        return value;
+      case _GGUF_TYPE_UINT32:
+      case _GGUF_TYPE_INT32:
+        return _u32();
+      case _GGUF_TYPE_UINT64:
+      case _GGUF_TYPE_INT64:
+        return _u64();
+      case _GGUF_TYPE_FLOAT32:
+        _skip(4);
+        return null;
+      case _GGUF_TYPE_FLOAT64:
+        _skip(8);
+        return null;
+      case _GGUF_TYPE_STRING:
+        _skip(_u64());
+        return null;
+    }
+    throw Exception("unknown GGUF value type $type");
+  }
+
+  AiliaLLMModelInfo readInfo() {
+    if (_u32() != _GGUF_MAGIC) {
+      throw Exception("not a GGUF file");
+    }
+    final int version = _u32();
+    if (version < 2) {
+      throw Exception("unsupported GGUF version $version");
+    }
+    _u64(); // tensor count
+    final int kvCount = _u64();
+
+    String architecture = "";
+    final Map<String, List<int>> values = {};
+    for (int i = 0; i < kvCount; i++) {
+      final String key = _string();
+      final int type = _u32();
+      if (type == _GGUF_TYPE_STRING) {
+        final String value = _string();
+        if (key == "general.architecture") {
+          architecture = value;
+        }
+      } else if (type == _GGUF_TYPE_ARRAY) {
+        final int elementType = _u32();
+        final int count = _u64();
+        final List<int> elements = List<int>.empty(growable: true);
+        for (int j = 0; j < count; j++) {
+          final int? value = _scalar(elementType);
+          if (value != null && count <= 1024) {
+            elements.add(value);
+          }
+        }
+        if (key == "tokenizer.ggml.tokens") {
+          elements.clear();
+          elements.add(count);
+        }
+        values[key] = elements;
+      } else {
+        final int? value = _scalar(type);
+        if (value != null) {
+          values[key] = [value];
+        }
+      }
+    }
+
+    int scalar(String name, int defaultValue) {
+      final List<int>? value = values["$architecture.$name"];
+      return value == null || value.isEmpty ? defaultValue : value[0];
+    }
+
+    final int nLayer = scalar("block_count", 0);
+    final int nEmbd = scalar("embedding_length", 0);
+    final int nHead = scalar("attention.head_count", 1);
+    final int headDim = nHead > 0 ? nEmbd ~/ nHead : 0;
+    final int keyLength = scalar("attention.key_length", headDim);
+    final int valueLength = scalar("attention.value_length", headDim);
+
+    // head_count_kv is either a single value or one value per layer.
+    final List<int> headCountKv =
+        values["$architecture.attention.head_count_kv"] ?? [nHead];
+    int kvElementsPerToken = 0;
+    for (int layer = 0; layer < nLayer; layer++) {
+      final int nHeadKv = headCountKv.length == nLayer
+          ? headCountKv[layer]
+          : headCountKv[0];
+      kvElementsPerToken += nHeadKv * (keyLength + valueLength);
+    }
+
+    final List<int>? tokens = values["tokenizer.ggml.tokens"];
+    return AiliaLLMModelInfo(
+        _file.lengthSync(),
+        scalar("context_length", 4096),
+        tokens == null ? 0 : tokens[0],
+        nHead,
+        kvElementsPerToken);
+  }
+}
@@ -2,15 +2,22 @@ import 'dart:ffi';
 import 'dart:convert';
 import 'dart:typed_data';
 import 'dart:io';
+import 'dart:math';
 import 'package:ffi/ffi.dart';
 import 'dart:ffi';
 
 import 'ailia_llm.dart' as ailia_llm_dart;
+import 'ailia_llm_memory.dart';
+import 'ailia_llm_response_cache.dart';
+import 'ailia_llm_trace.dart';
+import 'ailia_llm_utf8.dart';
 
 const String BACKEND_CPU = "CPU";
 const String BACKEND_VULKAN = "Vulkan";
 const String BACKEND_METAL = "Metal";
 
+const int _MESSAGE_CACHE_SIZE = 1024;
+
 List<List<String>> _ailiaCommonGetLlmPath() {
   if (Platform.isAndroid || Platform.isLinux) {
     return [
@@ -51,16 +58,175 @@ typedef VkEnumerateInstanceVersionNative = Int32 Function(
 typedef VkEnumerateInstanceVersionDart = int Function(
     Pointer<Uint32> apiVersion);
 
+typedef MemfdCreateNative = Int32 Function(Pointer<Char> name, Uint32 flags);
+typedef MemfdCreateDart = int Function(Pointer<Char> name, int flags);
+typedef CloseNative = Int32 Function(Int32 fd);
+typedef CloseDart = int Function(int fd);
+
+const int _MFD_CLOEXEC = 1;
+
+// File holding model data which does not come from a file on disk.
+// On Linux and Android an anonymous memfd is used, so the data stays in RAM
+// and the library maps the same pages. Other platforms use a temporary file
+// which is kept while the model is open, because Windows does not allow
+// removing a file mapped by the library.
+class _AiliaLLMModelBuffer {
+  final String path;
+  final int fd;
+
+  _AiliaLLMModelBuffer(this.path, this.fd);
+
+  static _AiliaLLMModelBuffer create() {
+    if (Platform.isLinux || Platform.isAndroid) {
+      try {
+        final MemfdCreateDart memfdCreate = DynamicLibrary.process()
+            .lookupFunction<MemfdCreateNative, MemfdCreateDart>('memfd_create');
+        final Pointer<Char> name =
+            "ailia_llm_model".toNativeUtf8().cast<Char>();
+        final int fd = memfdCreate(name, _MFD_CLOEXEC);
+        malloc.free(name);
+        if (fd >= 0) {
+          return _AiliaLLMModelBuffer("/proc/self/fd/$fd", fd);
+        }
+      } on ArgumentError {}
+    }
+    final Directory dir = Directory.systemTemp.createTempSync("ailia_llm");
+    return _AiliaLLMModelBuffer("${dir.path}/model.gguf", -1);
+  }
+
+  // Whether the buffer must outlive the open call.
+  bool get isFile => fd < 0;
+
+  void release() {
+    if (fd >= 0) {
+      final CloseDart close = DynamicLibrary.process()
+          .lookupFunction<CloseNative, CloseDart>('close');
+      close(fd);
+      return;
+    }
+    try {
+      File(path).parent.deleteSync(recursive: true);
+    } on FileSystemException {}
+  }
+}
+
+// Registry of loaded ailia LLM libraries and their FFI bindings.
+// Static state is per isolate: a library is loaded at most once per isolate
+// and shared by every AiliaLLMModel of that isolate using the same backend.
+// Another isolate, such as AiliaLLMIsolate, has its own registry.
+// Libraries stay loaded when the last user releases them, so switching
+// models does not pay the load latency again; call
+// AiliaLLMModel.releaseUnusedLibraries() to unload them.
+class _AiliaLLMLibrary {
+  static final Map<String, _AiliaLLMLibrary> _loaded = {};
+
+  final String path;
+  final DynamicLibrary library;
+  final ailia_llm_dart.ailiaLlmFFI ffi;
+  int refCount = 0;
+  List<String>? nativeBackends;
+
+  _AiliaLLMLibrary(this.path, this.library)
+      : ffi = ailia_llm_dart.ailiaLlmFFI(library);
+
+  // Load the library if needed without taking a reference.
+  static _AiliaLLMLibrary load(String path) {
+    _AiliaLLMLibrary? entry = _loaded[path];
+    if (entry == null) {
+      entry = _AiliaLLMLibrary(path, _ailiaCommonGetLibrary(path));
+      _loaded[path] = entry;
+    }
+    return entry;
+  }
+
+  static _AiliaLLMLibrary acquire(String path) {
+    _AiliaLLMLibrary entry = load(path);
+    entry.refCount++;
+    return entry;
+  }
+
+  static void release(String path) {
+    _AiliaLLMLibrary? entry = _loaded[path];
+    if (entry != null && entry.refCount > 0) {
+      entry.refCount--;
+    }
+  }
+
+  static void closeUnused() {
+    _loaded.removeWhere((path, entry) {
+      if (entry.refCount > 0) {
+        return false;
+      }
+      if (!Platform.isIOS) {
+        entry.library.close();
+      }
+      return true;
+    });
+  }
+}
+
+/// Result of AiliaLLMModel.generateN.
+class AiliaLLMGenerateResult {
+  /// Generated text.
+  final String text;
+
+  /// End offset of each generated token in text.
+  final List<int> offsets;
+
+  /// Whether the generation is finished.
+  final bool done;
+
+  AiliaLLMGenerateResult(this.text, this.offsets, this.done);
+}
+
 class AiliaLLMModel {
   static List<List<String>> _backend = List<List<String>>.empty();
 
   Pointer<Pointer<ailia_llm_dart.AILIALLM>> pLLm = nullptr;
-  DynamicLibrary? _library;
+  String _libraryPath = "";
   dynamic dllHandle;
   String _currentBackend = "";
+  String _modelPath = "";
   bool _contextFull = false;
-  Uint8List _buf = Uint8List(0);
-  String _beforeText = "";
+  // GGUF header of the opened model, read on first use from _modelFile.
+  AiliaLLMModelInfo? _modelInfo;
+  String _modelFile = "";
+
+  // Temporary file of the model opened by openMemory or openStream.
+  _AiliaLLMModelBuffer? _modelBuffer;
+
+  // Sampling parameters, defaults of ailiaLLMSetSamplingParams.
+  int _topK = 40;
+  double _topP = 0.9;
+  double _temp = 0.4;
+  int _dist = 1234;
+  bool _reseedEachPrompt = false;
+
+  // Response cache, replayed deltas and deltas being recorded.
+  AiliaLLMResponseCache? _responseCache;
+  List<String>? _replay;
+  int _replayIndex = 0;
+  List<String>? _recording;
+  String _recordingKey = "";
+
+  // Per message caches, least recently used first. The token counts depend
+  // on the tokenizer and are cleared by open().
+  final Map<String, int> _tokenCountCache = {};
+  final Map<String, Uint8List> _encodeCache = {};
+  // Keeps an incomplete UTF-8 character at the end of the last token.
+  final AiliaLLMUtf8Decoder _utf8 = AiliaLLMUtf8Decoder();
+
+  // Native buffers for setPrompt, reused across calls.
+  Pointer<Uint8> _promptArena = nullptr;
+  int _promptArenaSize = 0;
+  Pointer<ailia_llm_dart.AILIALLMChatMessage> _promptMessages = nullptr;
+  int _promptMessagesCapacity = 0;
+
+  // Native buffers for generate, reused across tokens.
+  Pointer<Uint32> _generateDone = nullptr;
+  Pointer<UnsignedInt> _generateTextSize = nullptr;
+  Pointer<Uint8> _generateText = nullptr;
+  int _generateTextCapacity = 0;
 
   AiliaLLMModel() {}
 
@@ -90,10 +256,19 @@ class AiliaLLMModel {
     return false;
   }
 
-  static List<String> getBackendList() {
+  /// Get the list of available backends.
+  /// The probe result is cached for the process. When cachePath is given,
+  /// the result is also persisted to that file and reused on the next
+  /// start, which skips the Vulkan check and the library loads. The
+  /// persisted result is discarded when the OS version or the size or
+  /// modification time of the libraries or the executable changes.
+  static List<String> getBackendList({String cachePath = ""}) {
     if (_backend.length > 0) {
       return _backend[1];
     }
+    if (cachePath != "" && _loadBackendCache(cachePath)) {
+      return _backend[1];
+    }
     _backend = List<List<String>>.empty(growable: true);
     _backend.add(List<String>.empty(growable: true));
     _backend.add(List<String>.empty(growable: true));
@@ -107,45 +282,174 @@ class AiliaLLMModel {
       }
       // Continue
       try {
-        DynamicLibrary library = _ailiaCommonGetLibrary(libraries[0][i]);
+        // Keep the library loaded so that open() can reuse it.
+        _AiliaLLMLibrary.load(libraries[0][i]);
         _backend[0].add(libraries[0][i]);
         _backend[1].add(libraries[1][i]);
-        library.close();
       } on Exception {
       } on ArgumentError {}
     }
+    if (cachePath != "") {
+      _saveBackendCache(cachePath);
+    }
     return _backend[1];
   }
 
-  /// Initialize the context using the given model and parameters.
-  void open(String modelPath, int nCtx, {String backend = ""}) {
-    if (pLLm != nullptr) {
-      if (pLLm.value != nullptr) {
-        dllHandle.ailiaLLMDestory(pLLm.value);
+  static bool _loadBackendCache(String cachePath) {
+    try {
+      final file = File(cachePath);
+      if (!file.existsSync()) {
+        return false;
+      }
+      final Map<String, dynamic> cache = jsonDecode(file.readAsStringSync());
+      if (cache["os"] != Platform.operatingSystemVersion ||
+          cache["fingerprint"] != _libraryFingerprint()) {
+        return false;
+      }
+      final List<String> paths = (cache["libraries"] as List).cast<String>();
+      final List<String> names = (cache["backends"] as List).cast<String>();
+      if (paths.isEmpty || paths.length != names.length) {
+        return false;
+      }
+      _backend = [paths, names];
+      return true;
+    } on Exception {
+      return false;
+    } on TypeError {
+      return false;
+    }
+  }
+
+  // Size and modification time of the library files and of the executable,
+  // so that an update of the libraries or of the app invalidates the cache.
+  // Libraries given by name are looked up next to the executable.
+  static String _libraryFingerprint() {
+    final String executable = Platform.resolvedExecutable;
+    final String dir = File(executable).parent.path;
+    final List<String> files = [executable];
+    for (final String name in _ailiaCommonGetLlmPath()[0]) {
+      files.addAll([name, "$dir/$name", "$dir/lib/$name"]);
+    }
+    final StringBuffer fingerprint = StringBuffer();
+    for (final String path in files) {
+      final FileStat stat = FileStat.statSync(path);
+      if (stat.type != FileSystemEntityType.notFound) {
+        fingerprint.write(
+            "$path:${stat.size}:${stat.modified.millisecondsSinceEpoch};");
       }
     }
+    return fingerprint.toString();
+  }
+
+  static void _saveBackendCache(String cachePath) {
+    try {
+      File(cachePath).writeAsStringSync(jsonEncode({
+        "os": Platform.operatingSystemVersion,
+        "fingerprint": _libraryFingerprint(),
+        "libraries": _backend[0],
+        "backends": _backend[1],
+      }));
+    } on FileSystemException {}
+  }
 
+  /// Get the computational environments reported by the library of the
+  /// given backend (ailiaLLMGetBackendCount / ailiaLLMGetBackendName).
+  /// This shows which kernels the library actually uses on this host,
+  /// while getBackendList only lists the libraries that can be loaded.
+  static List<String> getNativeBackendNames({String backend = ""}) {
+    List<String> backendList = getBackendList();
     if (backend == "") {
-      backend = _backend[1][0];
+      if (backendList.isEmpty) {
+        throw Exception("ailiaLLM backend not found");
+      }
+      backend = backendList[0];
+    }
+    int index = backendList.indexOf(backend);
+    if (index < 0) {
+      throw Exception("ailiaLLM backend not found");
+    }
+    _AiliaLLMLibrary library = _AiliaLLMLibrary.load(_backend[0][index]);
+    if (library.nativeBackends != null) {
+      return library.nativeBackends!;
     }
 
-    if (_currentBackend != backend) {
-      if (_library != null) {
-        _library!.close();
-        _library = null;
-      }
-      List<String> backendList = getBackendList();
-      for (int i = 0; i < backendList.length; i++) {
-        if (backendList[i] == backend) {
-          _library = _ailiaCommonGetLibrary(_backend[0][i]);
-          dllHandle = ailia_llm_dart.ailiaLlmFFI(_library!);
-          _currentBackend = backend;
-          break;
+    List<String> names = List<String>.empty(growable: true);
+    final Pointer<UnsignedInt> count = malloc<UnsignedInt>();
+    final Pointer<Pointer<Char>> name = malloc<Pointer<Char>>();
+    try {
+      int status = library.ffi.ailiaLLMGetBackendCount(count);
+      if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+        throw Exception(
+            "ailiaLLMGetBackendCount returned an error status $status");
+      }
+      for (int i = 0; i < count.value; i++) {
+        status = library.ffi.ailiaLLMGetBackendName(name, i);
+        if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+          throw Exception(
+              "ailiaLLMGetBackendName returned an error status $status");
         }
+        names.add(name.value.cast<Utf8>().toDartString());
+      }
+    } finally {
+      malloc.free(name);
+      malloc.free(count);
+    }
+    library.nativeBackends = names;
+    return names;
+  }
+
+  /// Unload the libraries which are not used by any model.
+  static void releaseUnusedLibraries() {
+    _AiliaLLMLibrary.closeUnused();
+  }
+
+  /// Estimate the memory used by a model with a context of nCtx tokens
+  /// (0 is the model default). Only the GGUF header is read.
+  static AiliaLLMMemoryEstimate estimateMemory(String modelPath, int nCtx) {
+    return AiliaLLMModelInfo.read(modelPath).estimate(nCtx);
+  }
+
+  /// Initialize the context using the given model and parameters.
+  /// When memoryBudget (bytes) is given, nCtx is reduced to the largest
+  /// context length whose estimated memory fits in the budget.
+  void open(String modelPath, int nCtx,
+      {String backend = "", int memoryBudget = 0}) {
+    _destroyInstance();
+
+    // Set again only when the new model is opened.
+    _modelPath = "";
+    _modelInfo = null;
+    _modelFile = "";
+
+    // The GGUF header is only read when it is needed.
+    AiliaLLMModelInfo? modelInfo;
+    if (memoryBudget > 0) {
+      modelInfo = AiliaLLMModelInfo.read(modelPath);
+      nCtx = modelInfo.fitContextLength(nCtx, memoryBudget);
+      if (nCtx == 0) {
+        throw Exception(
+            "ailiaLLM model does not fit in the memory budget $memoryBudget");
+      }
+    }
+
+    List<String> backendList = getBackendList();
+    if (backend == "") {
+      if (backendList.isEmpty) {
+        throw Exception("ailiaLLM backend not found");
       }
-      if (_library == null) {
+      backend = backendList[0];
+    }
+
+    if (_currentBackend != backend) {
+      int index = backendList.indexOf(backend);
+      if (index < 0) {
         throw Exception("ailiaLLM backend not found");
       }
+      _AiliaLLMLibrary library = _AiliaLLMLibrary.acquire(_backend[0][index]);
+      _releaseLibrary();
+      dllHandle = library.ffi;
+      _libraryPath = library.path;
+      _currentBackend = backend;
     }
 
     pLLm = malloc<Pointer<ailia_llm_dart.AILIALLM>>();
@@ -156,6 +460,7 @@ class AiliaLLMModel {
       throw Exception("ailiaLLMCreate returned an error status $status");
     }
 
+    int span = AiliaLLMTrace.begin();
     if (Platform.isWindows) {
       Pointer<WChar> path = modelPath.toNativeUtf16().cast<WChar>();
       status = dllHandle.ailiaLLMOpenModelFileW(pLLm.value, path, nCtx);
@@ -165,13 +470,222 @@ class AiliaLLMModel {
       status = dllHandle.ailiaLLMOpenModelFileA(pLLm.value, path, nCtx);
       malloc.free(path);
     }
+    AiliaLLMTrace.end("ailiaLLMOpenModelFile", span);
     if (status != 0) {
       throw Exception("ailiaLLMOpenModelFile returned an error status $status");
     }
+    _modelPath = modelPath;
+    _modelFile = modelPath;
+    _modelInfo = modelInfo;
+    _tokenCountCache.clear();
+  }
+
+  /// Get the estimated memory usage of the opened model, using the context
+  /// length allocated by the library.
+  AiliaLLMMemoryEstimate getMemoryUsage() {
+    if (pLLm == nullptr) {
+      throw Exception("ailia LLM not initialized.");
+    }
+    _readModelInfo();
+    if (_modelInfo == null) {
+      throw Exception("ailiaLLM failed to read the GGUF header");
+    }
+    final Pointer<UnsignedInt> contextSize = malloc<UnsignedInt>();
+    int status = dllHandle.ailiaLLMGetContextSize(pLLm.value, contextSize);
+    int nCtx = contextSize.value;
+    malloc.free(contextSize);
+    if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+      throw Exception(
+          "ailiaLLMGetContextSize returned an error status $status");
+    }
+    return _modelInfo!.estimate(nCtx);
+  }
+
+  void _readModelInfo() {
+    if (_modelInfo != null || _modelFile == "") {
+      return;
+    }
+    try {
+      _modelInfo = AiliaLLMModelInfo.read(_modelFile);
+    } on Exception {
+      _modelInfo = null;
+    }
+    _modelFile = "";
+  }
+
+  /// Initialize the context using a model held in memory, for example a
+  /// model decrypted or unpacked from an asset bundle.
+  /// On Linux and Android the data is copied into an anonymous memory file,
+  /// so nothing is written to disk. On macOS, iOS and Windows the data is
+  /// written to a temporary file, which is deleted by close() or the next
+  /// open.
+  void openMemory(Uint8List data, int nCtx,
+      {String backend = "", int memoryBudget = 0}) {
+    final buffer = _AiliaLLMModelBuffer.create();
+    try {
+      File(buffer.path).writeAsBytesSync(data, flush: true);
+      open(buffer.path, nCtx, backend: backend, memoryBudget: memoryBudget);
+    } catch (e) {
+      buffer.release();
+      rethrow;
+    }
+    _keepModelBuffer(buffer);
+  }
+
+  /// Initialize the context using a model read from a stream, for example
+  /// the output of a download or a decompressor.
+  /// The chunks are written as they arrive, to an anonymous memory file or
+  /// a temporary file on disk as in openMemory.
+  Future<void> openStream(Stream<List<int>> stream, int nCtx,
+      {String backend = "", int memoryBudget = 0}) async {
+    final buffer = _AiliaLLMModelBuffer.create();
+    try {
+      final IOSink sink = File(buffer.path).openWrite();
+      try {
+        await sink.addStream(stream);
+        await sink.flush();
+      } finally {
+        await sink.close();
+      }
+      open(buffer.path, nCtx, backend: backend, memoryBudget: memoryBudget);
+    } catch (e) {
+      buffer.release();
+      rethrow;
+    }
+    _keepModelBuffer(buffer);
+  }
+
+  // A memory file can be closed once the library has opened it, a
+  // temporary file is deleted when the model is destroyed.
+  void _keepModelBuffer(_AiliaLLMModelBuffer buffer) {
+    _modelPath = "";
+    if (buffer.isFile) {
+      _modelBuffer = buffer;
+    } else {
+      // The memory file cannot be read once it is closed. Reading its
+      // header does not touch the disk.
+      _readModelInfo();
+      buffer.release();
+    }
+  }
+
+  /// Move the first request latency to an earlier point.
+  /// The model file is read once to bring the weights into the OS page cache
+  /// (when preloadFile is true), then a short prompt is processed and one
+  /// token is generated so that compute buffers and kernels are initialized.
+  /// The sampler is then reseeded with the current seed, so the next request
+  /// generates the same output as right after open. Call it before the
+  /// first request, as it also restarts a random stream already in use.
+  void warmup({bool preloadFile = true}) {
+    if (pLLm == nullptr) {
+      throw Exception("ailia LLM not initialized.");
+    }
+
+    // Models opened from memory are already resident.
+    if (preloadFile && _modelPath != "") {
+      preloadModelFile(_modelPath);
+    }
+
+    // The dummy request must run the model, not a cached response.
+    final AiliaLLMResponseCache? responseCache = _responseCache;
+    _responseCache = null;
+    try {
+      setPrompt([
+        {"role": "user", "content": "Hello"}
+      ]);
+      if (!_contextFull) {
+        generate();
+      }
+    } finally {
+      _responseCache = responseCache;
+    }
+
+    // The dummy token used random numbers of the sampler.
+    _applySamplingParams(_dist);
+
+    _contextFull = false;
+    _utf8.reset();
+  }
+
+  /// Read the whole file so that the pages mapped by the library are in the
+  /// OS page cache and do not fault on first access. It can be called
+  /// before or after open. Returns the number of bytes read.
+  static int preloadModelFile(String modelPath) {
+    final file = File(modelPath).openSync();
+    try {
+      final int total = file.lengthSync();
+      final chunk = Uint8List(4 * 1024 * 1024);
+      int loaded = 0;
+      while (loaded < total) {
+        int size = file.readIntoSync(chunk);
+        if (size <= 0) {
+          break;
+        }
+        loaded += size;
+      }
+      return loaded;
+    } finally {
+      file.closeSync();
+    }
+  }
+
+  /// Asynchronous version of preloadModelFile.
+  /// The file is split into parallelism ranges which are read concurrently
+  /// on the IO threads. progress is called with the number of bytes read so
+  /// far, and the reads stop when cancelled returns true.
+  static Future<int> preloadModelFileAsync(String modelPath,
+      {int parallelism = 4,
+      void Function(int loaded, int total)? progress,
+      bool Function()? cancelled}) async {
+    final int total = File(modelPath).lengthSync();
+    const int chunkSize = 4 * 1024 * 1024;
+    int rangeSize = (total + parallelism - 1) ~/ parallelism;
+    rangeSize = (rangeSize + chunkSize - 1) ~/ chunkSize * chunkSize;
+    int loaded = 0;
+
+    Future<void> readRange(int start, int end) async {
+      final file = await File(modelPath).open();
+      try {
+        final chunk = Uint8List(chunkSize);
+        await file.setPosition(start);
+        int position = start;
+        while (position < end) {
+          if (cancelled != null && cancelled()) {
+            break;
+          }
+          int size =
+              await file.readInto(chunk, 0, min(chunkSize, end - position));
+          if (size <= 0) {
+            break;
+          }
+          position += size;
+          loaded += size;
+          if (progress != null) {
+            progress(loaded, total);
+          }
+        }
+      } finally {
+        await file.close();
+      }
+    }
+
+    final reads = List<Future<void>>.empty(growable: true);
+    for (int start = 0; start < total; start += rangeSize) {
+      reads.add(readRange(start, min(start + rangeSize, total)));
+    }
+    await Future.wait(reads);
+    return loaded;
   }
 
   /// Free memory allocated natively.
   void close() {
+    _destroyInstance();
+    _freePromptArena();
+    _freeGenerateBuffers();
+    _releaseLibrary();
+  }
+
+  void _destroyInstance() {
     if (pLLm != nullptr) {
       if (pLLm.value != nullptr) {
         dllHandle.ailiaLLMDestroy(pLLm.value);
@@ -180,17 +694,43 @@ class AiliaLLMModel {
       malloc.free(pLLm);
       pLLm = nullptr;
     }
+    _modelBuffer?.release();
+    _modelBuffer = null;
+  }
+
+  void _releaseLibrary() {
+    if (_libraryPath != "") {
+      _AiliaLLMLibrary.release(_libraryPath);
+      _libraryPath = "";
+      _currentBackend = "";
+    }
   }
 
-  void setSamplingParams(int top_k, double top_p, double temp, int dist) {
+  /// Set the sampling parameters.
+  /// By default the random stream continues across requests. When
+  /// reseedEachPrompt is true, the parameters are applied again by every
+  /// setPrompt, so the random stream of each request starts from the seed
+  /// (dist) and does not depend on the previous requests.
+  void setSamplingParams(int top_k, double top_p, double temp, int dist,
+      {bool reseedEachPrompt = false}) {
     if (pLLm == nullptr) {
       throw Exception("ailia LLM not initialized.");
     }
 
+    _topK = top_k;
+    _topP = top_p;
+    _temp = temp;
+    _dist = dist;
+    _reseedEachPrompt = reseedEachPrompt;
+    _applySamplingParams(dist);
+  }
+
+  void _applySamplingParams(int dist) {
     var status = dllHandle.ailiaLLMSetSamplingParams(
-        pLLm.value, top_k, top_p, temp, dist);
+        pLLm.value, _topK, _topP, _temp, dist);
     if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
-      throw Exception("ailiaLLMGenerate returned an error status $status");
+      throw Exception(
+          "ailiaLLMSetSamplingParams returned an error status $status");
     }
   }
 
@@ -198,58 +738,139 @@ class AiliaLLMModel {
   /// The prompt will be formatted according to the selected format.
   /// messages must be an array of object with two string properties
   /// named 'role' and 'content'.
-  void setPrompt(List<Map<String, dynamic>> messages) {
+  /// When seed is given, the sampler is reseeded with it before this
+  /// request, so the same seed always reproduces the same output. The
+  /// following requests continue from that random stream unless they are
+  /// reseeded too.
+  void setPrompt(List<Map<String, dynamic>> messages, {int? seed}) {
     if (pLLm == nullptr) {
       throw Exception("ailia LLM not initialized.");
     }
 
-    // Allocate an array of ailia_llm_chat_message_t and initialize it
-    // with the messages data.
-    final messagesPtr =
-        calloc<ailia_llm_dart.AILIALLMChatMessage>(messages.length);
+    _replay = null;
+    _recording = null;
+    String? key;
+    // A cache hit does not run the sampler, so only requests which reseed
+    // it on every prompt give the same output with or without the cache.
+    if (_responseCache != null && _modelPath != "" && _reseedEachPrompt) {
+      key = _responseCacheKey(messages, seed ?? _dist);
+      final List<String>? deltas = _responseCache!.lookup(key);
+      if (deltas != null) {
+        _replay = deltas;
+        _replayIndex = 0;
+        _contextFull = false;
+        return;
+      }
+    }
 
-    try {
-      for (var i = 0; i < messages.length; i++) {
-        if (!messages[i].containsKey("content")) {
-          throw Exception("missing 'content' property");
-        }
-        if (!messages[i].containsKey("role")) {
-          throw Exception("missing 'role' property");
-        }
+    int span = AiliaLLMTrace.begin();
 
-        final content = messages[i]['content'] as String;
-        final role = messages[i]['role'] as String;
-        final p = messagesPtr[i];
+    // Encode the messages first so that a missing property does not leave
+    // the arena half written.
+    final encoded = List<Uint8List>.empty(growable: true);
+    int totalSize = 0;
+    for (var i = 0; i < messages.length; i++) {
+      if (!messages[i].containsKey("content")) {
+        throw Exception("missing 'content' property");
+      }
+      if (!messages[i].containsKey("role")) {
+        throw Exception("missing 'role' property");
+      }
+      final role = _encodeMessageString(messages[i]['role'] as String);
+      final content = _encodeMessageString(messages[i]['content'] as String);
+      encoded.add(role);
+      encoded.add(content);
+      totalSize += role.length + content.length + 2;
+    }
+
+    // Pack all strings into the arena and point the messages into it.
+    _reservePromptArena(totalSize, messages.length);
+    final arena = _promptArena.asTypedList(totalSize);
+    int offset = 0;
+    for (var i = 0; i < messages.length; i++) {
+      final p = _promptMessages[i];
+      p.role = (_promptArena + offset).cast<Char>();
+      offset = _packString(arena, offset, encoded[i * 2]);
+      p.content = (_promptArena + offset).cast<Char>();
+      offset = _packString(arena, offset, encoded[i * 2 + 1]);
+    }
+
+    _contextFull = false;
+    _utf8.reset();
 
-        p.content = content.toNativeUtf8().cast<Char>();
-        p.role = role.toNativeUtf8().cast<Char>();
+    // Sampling parameters must be set before ailiaLLMSetPrompt.
+    if (seed != null || _reseedEachPrompt) {
+      _applySamplingParams(seed ?? _dist);
+    }
+
+    AiliaLLMTrace.end("setPrompt.marshal", span);
+
+    // Applies the chat template, tokenizes and runs the prefill.
+    span = AiliaLLMTrace.begin();
+    int status = dllHandle.ailiaLLMSetPrompt(
+        pLLm.value, _promptMessages, messages.length);
+    AiliaLLMTrace.end("ailiaLLMSetPrompt", span);
+    if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+      if (status == ailia_llm_dart.AILIA_LLM_STATUS_CONTEXT_FULL) {
+        _contextFull = true;
+        return;
       }
+      throw Exception("ailiaLLMSetPrompt returned an error status $status");
+    }
 
-      _contextFull = false;
-      _buf = Uint8List(0);
-      _beforeText = "";
+    // Only a prompt accepted by the library is recorded.
+    if (key != null) {
+      _recording = List<String>.empty(growable: true);
+      _recordingKey = key;
+    }
+  }
 
-      int status =
-          dllHandle.ailiaLLMSetPrompt(pLLm.value, messagesPtr, messages.length);
-      if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
-        if (status == ailia_llm_dart.AILIA_LLM_STATUS_CONTEXT_FULL) {
-          _contextFull = true;
-          return;
-        }
-        throw Exception("ailiaLLMSetPrompt returned an error status $status");
+  // Write a null terminated string into the arena and return the next offset.
+  int _packString(Uint8List arena, int offset, Uint8List value) {
+    arena.setRange(offset, offset + value.length, value);
+    arena[offset + value.length] = 0;
+    return offset + value.length + 1;
+  }
+
+  // Grow the native buffers used by setPrompt. They are reused between calls
+  // and only released by close().
+  void _reservePromptArena(int size, int messageCount) {
+    if (_promptArena == nullptr || _promptArenaSize < size) {
+      int newSize = _promptArenaSize == 0 ? 4096 : _promptArenaSize;
+      while (newSize < size) {
+        newSize *= 2;
       }
-    } finally {
-      // free string
-      for (var i = 0; i < messages.length; i++) {
-        final p = messagesPtr[i];
-        if (p.content != nullptr) {
-          malloc.free(p.content);
-        }
-        if (p.role != nullptr) {
-          malloc.free(p.role);
-        }
+      if (_promptArena != nullptr) {
+        malloc.free(_promptArena);
       }
-      malloc.free(messagesPtr);
+      _promptArena = malloc<Uint8>(newSize);
+      _promptArenaSize = newSize;
+    }
+    if (_promptMessages == nullptr || _promptMessagesCapacity < messageCount) {
+      int newCapacity =
+          _promptMessagesCapacity == 0 ? 16 : _promptMessagesCapacity;
+      while (newCapacity < messageCount) {
+        newCapacity *= 2;
+      }
+      if (_promptMessages != nullptr) {
+        malloc.free(_promptMessages);
+      }
+      _promptMessages =
+          calloc<ailia_llm_dart.AILIALLMChatMessage>(newCapacity);
+      _promptMessagesCapacity = newCapacity;
+    }
+  }
+
+  void _freePromptArena() {
+    if (_promptArena != nullptr) {
+      malloc.free(_promptArena);
+      _promptArena = nullptr;
+      _promptArenaSize = 0;
+    }
+    if (_promptMessages != nullptr) {
+      malloc.free(_promptMessages);
+      _promptMessages = nullptr;
+      _promptMessagesCapacity = 0;
     }
   }
 
@@ -260,79 +881,247 @@ class AiliaLLMModel {
       throw Exception("ailia LLM not initialized.");
     }
 
-    Pointer<Uint32> done = malloc<Uint32>();
+    if (_replay != null) {
+      if (_replayIndex < _replay!.length) {
+        return _replay![_replayIndex++];
+      }
+      return null;
+    }
+
+    final int textLength = _generateStep();
+    if (textLength < 0) {
+      return null;
+    }
+
+    // Only the new bytes are decoded, up to the last complete character.
+    int span = AiliaLLMTrace.begin();
+    String deltaText = _utf8.convert(_generateText.asTypedList(textLength));
+    AiliaLLMTrace.end("generate.utf8", span);
+
+    _recording?.add(deltaText);
+    return deltaText;
+  }
+
+  /// Ask the model to generate the next token and return its raw UTF-8
+  /// bytes, without decoding them. The bytes may end in the middle of a
+  /// multi-byte character, which continues in the next token.
+  /// The returned list is a view of a native buffer, valid until the next
+  /// call. Returns null when the generation is finished.
+  /// Do not mix with generate() within one prompt.
+  Uint8List? generateBytes() {
+    if (pLLm == nullptr) {
+      throw Exception("ailia LLM not initialized.");
+    }
+
+    // Cached responses are stored as text.
+    if (_replay != null || _recording != null) {
+      final String? deltaText = generate();
+      return deltaText == null ? null : utf8.encode(deltaText);
+    }
+
+    final int textLength = _generateStep();
+    if (textLength < 0) {
+      return null;
+    }
+    return _generateText.asTypedList(textLength);
+  }
+
+  // Generate one token and copy its delta text into _generateText.
+  // Returns the length of the delta text, or -1 when the generation is
+  // finished.
+  int _generateStep() {
+    _reserveGenerateBuffers(0);
+
+    // Decodes and samples one token.
+    int span = AiliaLLMTrace.begin();
     var status = dllHandle.ailiaLLMGenerate(
       pLLm.value,
-      done,
+      _generateDone,
     );
-    int doneFlag = done.value;
-    malloc.free(done);
+    AiliaLLMTrace.end("ailiaLLMGenerate", span);
+    int doneFlag = _generateDone.value;
 
     _contextFull = false;
 
     if (doneFlag == 1) {
-      return null;
+      if (_recording != null) {
+        _responseCache?.store(_recordingKey, _recording!);
+        _recording = null;
+      }
+      return -1;
     }
 
     if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+      // Incomplete responses are not cached.
+      _recording = null;
       if (status == ailia_llm_dart.AILIA_LLM_STATUS_CONTEXT_FULL) {
         _contextFull = true;
-        return null;
+        return -1;
       }
       throw Exception("ailiaLLMGenerate returned an error status $status");
     }
 
-    // Try first with gBuff which is a buffer associated to this
-    // prompt instance.
-    final Pointer<UnsignedInt> size = malloc<UnsignedInt>();
-    dllHandle.ailiaLLMGetDeltaTextSize(pLLm.value, size);
+    span = AiliaLLMTrace.begin();
+    dllHandle.ailiaLLMGetDeltaTextSize(pLLm.value, _generateTextSize);
+    final int size = _generateTextSize.value;
+    _reserveGenerateBuffers(size);
+    dllHandle.ailiaLLMGetDeltaText(
+        pLLm.value, _generateText.cast<Char>(), size);
+    AiliaLLMTrace.end("ailiaLLMGetDeltaText", span);
 
-    final Pointer<Char> byteBuffer = malloc<Char>(size.value);
-    dllHandle.ailiaLLMGetDeltaText(pLLm.value, byteBuffer, size.value);
+    // size includes the null terminator.
+    return size > 0 ? size - 1 : 0;
+  }
 
-    var buffer = Uint8List(size.value - 1);
-    for (var i = 0; i < size.value - 1; i++) {
-      buffer[i] = byteBuffer.elementAt(i).value;
+  /// Generate up to maxTokens tokens in one call, or until timeBudget has
+  /// elapsed. Returns the text with the end offset of each token in it.
+  /// done is true when the generation is finished (see generate).
+  AiliaLLMGenerateResult generateN(int maxTokens, {Duration? timeBudget}) {
+    final Stopwatch stopwatch = Stopwatch()..start();
+    final StringBuffer text = StringBuffer();
+    final List<int> offsets = List<int>.empty(growable: true);
+    bool done = false;
+    while (offsets.length < maxTokens) {
+      final String? deltaText = generate();
+      if (deltaText == null) {
+        done = true;
+        break;
+      }
+      text.write(deltaText);
+      offsets.add(text.length);
+      if (timeBudget != null && stopwatch.elapsed >= timeBudget) {
+        break;
+      }
     }
+    return AiliaLLMGenerateResult(text.toString(), offsets, done);
+  }
 
-    Uint8List combinedUint8List = Uint8List(_buf.length + buffer.length);
-    combinedUint8List.setRange(0, _buf.length, _buf);
-    combinedUint8List.setRange(
-        _buf.length, _buf.length + buffer.length, buffer);
-    _buf = combinedUint8List;
-
-    malloc.free(size);
-    malloc.free(byteBuffer);
-
-    String deltaText = "";
-    try {
-      String text = utf8.decode(_buf);
-      if (_beforeText.length != text.length) {
-        deltaText = text.substring(_beforeText.length);
+  // Native buffers for generate, reused across tokens and only released
+  // by close().
+  void _reserveGenerateBuffers(int textSize) {
+    if (_generateDone == nullptr) {
+      _generateDone = malloc<Uint32>();
+      _generateTextSize = malloc<UnsignedInt>();
+    }
+    if (_generateText == nullptr || _generateTextCapacity < textSize) {
+      int newCapacity =
+          _generateTextCapacity == 0 ? 256 : _generateTextCapacity;
+      while (newCapacity < textSize) {
+        newCapacity *= 2;
+      }
+      if (_generateText != nullptr) {
+        malloc.free(_generateText);
       }
-      _beforeText = text;
-    } on FormatException catch (e) {
-      // unicode decode error
+      _generateText = malloc<Uint8>(newCapacity);
+      _generateTextCapacity = newCapacity;
     }
+  }
 
-    return deltaText;
+  void _freeGenerateBuffers() {
+    if (_generateDone != nullptr) {
+      malloc.free(_generateDone);
+      malloc.free(_generateTextSize);
+      _generateDone = nullptr;
+      _generateTextSize = nullptr;
+    }
+    if (_generateText != nullptr) {
+      malloc.free(_generateText);
+      _generateText = nullptr;
+      _generateTextCapacity = 0;
+    }
   }
 
   bool contextFull() {
     return _contextFull;
   }
 
+  /// Replay identical deterministic requests from cache (null disables it).
+  /// Only requests made after setSamplingParams with reseedEachPrompt are
+  /// cached. See AiliaLLMResponseCache.
+  void setResponseCache(AiliaLLMResponseCache? cache) {
+    _responseCache = cache;
+    _replay = null;
+    _recording = null;
+  }
+
+  // The model is identified by its path, size and modification time, and
+  // the runtime by the backend and the context size, which can change the
+  // generated tokens.
+  String _responseCacheKey(List<Map<String, dynamic>> messages, int seed) {
+    final FileStat stat = File(_modelPath).statSync();
+    final Pointer<UnsignedInt> contextSize = malloc<UnsignedInt>();
+    int status = dllHandle.ailiaLLMGetContextSize(pLLm.value, contextSize);
+    int nCtx = contextSize.value;
+    malloc.free(contextSize);
+    if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+      throw Exception(
+          "ailiaLLMGetContextSize returned an error status $status");
+    }
+    return jsonEncode({
+      "model": [_modelPath, stat.size, stat.modified.millisecondsSinceEpoch],
+      "runtime": [_currentBackend, nCtx],
+      "messages": [
+        for (final message in messages) [message["role"], message["content"]]
+      ],
+      "sampling": [_topK, _topP, _temp, seed],
+    });
+  }
+
   // Get token count
+  // The result is cached per text, so counting unchanged history messages
+  // again does not call the library.
   int getTokenCount(String text) {
     if (pLLm == nullptr) {
       throw Exception("ailia LLM not initialized.");
     }
 
+    final int? cached = _tokenCountCache.remove(text);
+    if (cached != null) {
+      _tokenCountCache[text] = cached;
+      return cached;
+    }
+
     final Pointer<UnsignedInt> count = malloc<UnsignedInt>();
+    int span = AiliaLLMTrace.begin();
     Pointer<Char> pText = text.toNativeUtf8().cast<Char>();
-    dllHandle.ailiaLLMGetTokenCount(pLLm.value, count, pText);
+    int status = dllHandle.ailiaLLMGetTokenCount(pLLm.value, count, pText);
+    AiliaLLMTrace.end("ailiaLLMGetTokenCount", span);
     int retCount = count.value;
+    malloc.free(pText);
     malloc.free(count);
+    if (status != ailia_llm_dart.AILIA_LLM_STATUS_SUCCESS) {
+      throw Exception("ailiaLLMGetTokenCount returned an error status $status");
+    }
+
+    _tokenCountCache[text] = retCount;
+    if (_tokenCountCache.length > _MESSAGE_CACHE_SIZE) {
+      _tokenCountCache.remove(_tokenCountCache.keys.first);
+    }
     return retCount;
   }
+
+  /// Get the sum of the token counts of the message contents.
+  /// The tokens added by the chat template are not included.
+  int getMessagesTokenCount(List<Map<String, dynamic>> messages) {
+    int total = 0;
+    for (var i = 0; i < messages.length; i++) {
+      total += getTokenCount(messages[i]['content'] as String);
+    }
+    return total;
+  }
+
+  // UTF-8 encoding of the message strings given to setPrompt.
+  Uint8List _encodeMessageString(String text) {
+    final Uint8List? cached = _encodeCache.remove(text);
+    if (cached != null) {
+      _encodeCache[text] = cached;
+      return cached;
+    }
+    final Uint8List encoded = utf8.encode(text);
+    _encodeCache[text] = encoded;
+    if (_encodeCache.length > _MESSAGE_CACHE_SIZE) {
+      _encodeCache.remove(_encodeCache.keys.first);
+    }
+    return encoded;
+  }
 }
@@ -0,0 +1,107 @@
+import 'ailia_llm_memory.dart';
+import 'ailia_llm_model.dart';
+
+class _AiliaLLMPoolEntry {
+  final String modelPath;
+  final int nCtx;
+  final String backend;
+  AiliaLLMModel? model;
+  int memory = 0;
+
+  _AiliaLLMPoolEntry(this.modelPath, this.nCtx, this.backend);
+}
+
+/// Keep several opened models resident up to a memory budget.
+/// Models are registered by name and opened on first use. When opening a
+/// model would exceed the budget, the least recently used models are
+/// closed. Switching between resident models is a map lookup.
+///
+/// A model returned by get() stays valid until it is evicted by a later
+/// get() of another model or by close().
+class AiliaLLMModelPool {
+  /// Memory budget in bytes, compared against AiliaLLMModel.estimateMemory.
+  final int memoryBudget;
+
+  final Map<String, _AiliaLLMPoolEntry> _entries = {};
+
+  // Resident model names, least recently used first.
+  final List<String> _resident = List<String>.empty(growable: true);
+  int _used = 0;
+
+  AiliaLLMModelPool(this.memoryBudget);
+
+  /// Register a model under name. The model is not opened until get().
+  void register(String name, String modelPath, int nCtx,
+      {String backend = ""}) {
+    if (_entries.containsKey(name)) {
+      evict(name);
+    }
+    _entries[name] = _AiliaLLMPoolEntry(modelPath, nCtx, backend);
+  }
+
+  /// Get the opened model registered under name, opening it if needed.
+  AiliaLLMModel get(String name) {
+    final _AiliaLLMPoolEntry? entry = _entries[name];
+    if (entry == null) {
+      throw Exception("ailiaLLM model $name is not registered");
+    }
+
+    if (entry.model != null) {
+      _resident.remove(name);
+      _resident.add(name);
+      return entry.model!;
+    }
+
+    final AiliaLLMMemoryEstimate estimate =
+        AiliaLLMModel.estimateMemory(entry.modelPath, entry.nCtx);
+    if (estimate.total > memoryBudget) {
+      throw Exception("ailiaLLM model $name does not fit in the memory budget "
+          "$memoryBudget");
+    }
+    while (_used + estimate.total > memoryBudget && _resident.isNotEmpty) {
+      evict(_resident.first);
+    }
+
+    final model = AiliaLLMModel();
+    try {
+      model.open(entry.modelPath, entry.nCtx, backend: entry.backend);
+    } catch (e) {
+      // Release the instance and the library reference taken by open.
+      model.close();
+      rethrow;
+    }
+    entry.model = model;
+    entry.memory = estimate.total;
+    _used += estimate.total;
+    _resident.add(name);
+    return model;
+  }
+
+  /// Whether the model registered under name is currently opened.
+  bool isResident(String name) {
+    return _entries[name]?.model != null;
+  }
+
+  /// Estimated memory of the resident models in bytes.
+  int get usedMemory => _used;
+
+  /// Close the model registered under name. It stays registered.
+  void evict(String name) {
+    final _AiliaLLMPoolEntry? entry = _entries[name];
+    if (entry == null || entry.model == null) {
+      return;
+    }
+    entry.model!.close();
+    entry.model = null;
+    _used -= entry.memory;
+    entry.memory = 0;
+    _resident.remove(name);
+  }
+
+  /// Close all the models.
+  void close() {
+    for (final name in List<String>.from(_resident)) {
+      evict(name);
+    }
+  }
+}
@@ -0,0 +1,114 @@
+import 'dart:convert';
+import 'dart:io';
+import 'dart:math';
+
+/// Exact-match cache of generated responses.
+/// Set it to a model with AiliaLLMModel.setResponseCache. A request whose
+/// model, messages and sampling parameters match a stored one is replayed
+/// by generate() without running the model.
+///
+/// Only deterministic requests are cached, which means requests made after
+/// setSamplingParams with reseedEachPrompt.
+///
+/// Requests are stored as a 128-bit digest of the request, so neither the
+/// memory nor the file keeps the prompts.
+class AiliaLLMResponseCache {
+  /// Maximum number of responses kept in memory.
+  final int capacity;
+
+  /// Optional append-only file storing the responses across runs.
+  final String path;
+
+  // Responses by request digest, least recently used first.
+  final Map<String, List<String>> _responses = {};
+
+  AiliaLLMResponseCache({this.capacity = 256, this.path = ""}) {
+    if (path != "") {
+      _load();
+    }
+  }
+
+  void _load() {
+    final file = File(path);
+    if (!file.existsSync()) {
+      return;
+    }
+    // Older lines would be evicted by the newer ones, so only the last
+    // capacity lines are parsed.
+    final List<String> lines = file.readAsLinesSync();
+    for (final line in lines.skip(max(0, lines.length - capacity))) {
+      try {
+        final Map<String, dynamic> record = jsonDecode(line);
+        _put(record["key"] as String,
+            (record["deltas"] as List).cast<String>());
+      } on FormatException {
+        // Ignore a line truncated by an interrupted write.
+      } on TypeError {}
+    }
+
+    // Compact the file when most of it is no longer used.
+    if (lines.length > capacity * 2) {
+      try {
+        file.writeAsStringSync(
+            _responses.entries
+                .map((entry) => _record(entry.key, entry.value))
+                .join(),
+            flush: true);
+      } on FileSystemException {}
+    }
+  }
+
+  static String _record(String key, List<String> deltas) {
+    return "${jsonEncode({"key": key, "deltas": deltas})}\n";
+  }
+
+  // 128-bit FNV-1a digest of the request, as two 64-bit lanes with
+  // different offset bases.
+  static String _digest(String request) {
+    const int prime = 0x100000001b3;
+    int low = 0xcbf29ce484222325;
+    int high = 0x6c62272e07bb0142;
+    for (final int byte in utf8.encode(request)) {
+      low = (low ^ byte) * prime;
+      high = (high ^ byte) * prime;
+      high ^= low >>> 29;
+    }
+    return high.toUnsigned(64).toRadixString(16).padLeft(16, "0") +
+        low.toUnsigned(64).toRadixString(16).padLeft(16, "0");
+  }
+
+  void _put(String key, List<String> deltas) {
+    _responses.remove(key);
+    _responses[key] = deltas;
+    if (_responses.length > capacity) {
+      _responses.remove(_responses.keys.first);
+    }
+  }
+
+  /// Get the stored deltas of a request, or null.
+  List<String>? lookup(String request) {
+    final String key = _digest(request);
+    final List<String>? deltas = _responses.remove(key);
+    if (deltas != null) {
+      _responses[key] = deltas;
+    }
+    return deltas;
+  }
+
+  /// Store the deltas generated for a request.
+  void store(String request, List<String> deltas) {
+    final String key = _digest(request);
+    _put(key, deltas);
+    if (path != "") {
+      try {
+        File(path).writeAsStringSync(_record(key, deltas),
+            mode: FileMode.append, flush: true);
+      } on FileSystemException {}
+    }
+  }
+
+  /// Remove the responses kept in memory. The file is not modified.
+  void clear() {
+    _responses.clear();
+  }
+}
@@ -0,0 +1,78 @@
+import 'dart:convert';
+import 'dart:io';
+import 'dart:typed_data';
+
+/// Opt-in tracing of the phases of AiliaLLMModel.
+/// Enable it with AiliaLLMTrace.enabled = true or by setting the environment
+/// variable AILIA_LLM_TRACE=1, then call AiliaLLMTrace.write to save the
+/// spans as Chrome trace JSON, which can be opened in Perfetto.
+/// When disabled, a span costs a single flag check.
+///
+/// Spans are recorded per isolate, so an isolate running a model (see
+/// AiliaLLMIsolate) writes its own trace.
+class AiliaLLMTrace {
+  static bool enabled = Platform.environment["AILIA_LLM_TRACE"] == "1";
+
+  static final Stopwatch _clock = Stopwatch()..start();
+  static final List<String> _names = List<String>.empty(growable: true);
+  static final Map<String, int> _nameIndex = {};
+
+  // Flat records of (name index, begin us, end us).
+  static Int64List _events = Int64List(3 * 4096);
+  static int _eventCount = 0;
+
+  /// Begin a span. Returns -1 when tracing is disabled.
+  static int begin() {
+    if (!enabled) {
+      return -1;
+    }
+    return _clock.elapsedMicroseconds;
+  }
+
+  /// End a span started by begin.
+  static void end(String name, int begin) {
+    if (begin < 0) {
+      return;
+    }
+    final int now = _clock.elapsedMicroseconds;
+    int? index = _nameIndex[name];
+    if (index == null) {
+      index = _names.length;
+      _names.add(name);
+      _nameIndex[name] = index;
+    }
+    if (_eventCount * 3 + 3 > _events.length) {
+      final grown = Int64List(_events.length * 2);
+      grown.setRange(0, _events.length, _events);
+      _events = grown;
+    }
+    final int offset = _eventCount * 3;
+    _events[offset] = index;
+    _events[offset + 1] = begin;
+    _events[offset + 2] = now;
+    _eventCount++;
+  }
+
+  /// Discard the recorded spans.
+  static void clear() {
+    _eventCount = 0;
+  }
+
+  /// Write the recorded spans as Chrome trace JSON.
+  static void write(String path) {
+    final events = List<Map<String, dynamic>>.empty(growable: true);
+    for (int i = 0; i < _eventCount; i++) {
+      final int offset = i * 3;
+      events.add({
+        "name": _names[_events[offset]],
+        "cat": "ailia_llm",
+        "ph": "X",
+        "ts": _events[offset + 1],
+        "dur": _events[offset + 2] - _events[offset + 1],
+        "pid": pid,
+        "tid": 1,
+      });
+    }
+    File(path).writeAsStringSync(jsonEncode({"traceEvents": events}));
+  }
+}
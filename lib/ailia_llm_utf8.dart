@@ -0,0 +1,55 @@
+import 'dart:convert';
+import 'dart:typed_data';
+
+/// Incremental UTF-8 decoder for the delta text of generated tokens.
+/// A token may end in the middle of a multi-byte character. The bytes of
+/// the incomplete character are kept and decoded with the next token, so
+/// the returned text never contains a split character. Malformed bytes are
+/// decoded as U+FFFD.
+class AiliaLLMUtf8Decoder {
+  Uint8List _pending = Uint8List(0);
+
+  /// Decode the bytes of the next token, preceded by the pending bytes of
+  /// the previous one, up to the last complete character.
+  String convert(List<int> bytes) {
+    final Uint8List joined = Uint8List(_pending.length + bytes.length);
+    joined.setRange(0, _pending.length, _pending);
+    joined.setRange(_pending.length, joined.length, bytes);
+
+    final int complete = completeLength(joined);
+    final String text = utf8.decode(
+        Uint8List.sublistView(joined, 0, complete),
+        allowMalformed: true);
+    _pending = Uint8List.fromList(Uint8List.sublistView(joined, complete));
+    return text;
+  }
+
+  /// Number of bytes waiting for the rest of their character.
+  int get pendingLength => _pending.length;
+
+  /// Drop the pending bytes, for a new prompt.
+  void reset() {
+    _pending = Uint8List(0);
+  }
+
+  /// Length of bytes without an incomplete UTF-8 sequence at the end.
+  static int completeLength(Uint8List bytes) {
+    final int length = bytes.length;
+    for (int i = length - 1; i >= 0 && i >= length - 4; i--) {
+      final int b = bytes[i];
+      if ((b & 0xC0) == 0x80) {
+        continue;
+      }
+      int needed = 1;
+      if ((b & 0xE0) == 0xC0) {
+        needed = 2;
+      } else if ((b & 0xF0) == 0xE0) {
+        needed = 3;
+      } else if ((b & 0xF8) == 0xF0) {
+        needed = 4;
+      }
+      return i + needed > length ? i : length;
+    }
+    return length;
+  }
+}
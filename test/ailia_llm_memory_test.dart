@@ -0,0 +1,155 @@
+import 'dart:convert';
+import 'dart:io';
+import 'dart:typed_data';
+
+import 'package:flutter_test/flutter_test.dart';
+import 'package:ailia_llm/ailia_llm_memory.dart';
+
+// Writer of synthetic GGUF headers, without tensors.
+class _GGUFWriter {
+  final BytesBuilder _bytes = BytesBuilder();
+  int _kvCount = 0;
+  final BytesBuilder _kv = BytesBuilder();
+
+  void _u32(BytesBuilder out, int value) {
+    out.add((ByteData(4)..setUint32(0, value, Endian.little))
+        .buffer
+        .asUint8List());
+  }
+
+  void _u64(BytesBuilder out, int value) {
+    out.add((ByteData(8)..setUint64(0, value, Endian.little))
+        .buffer
+        .asUint8List());
+  }
+
+  void _string(BytesBuilder out, String value) {
+    final List<int> bytes = utf8.encode(value);
+    _u64(out, bytes.length);
+    out.add(bytes);
+  }
+
+  void addUint32(String key, int value) {
+    _kvCount++;
+    _string(_kv, key);
+    _u32(_kv, 4);
+    _u32(_kv, value);
+  }
+
+  void addString(String key, String value) {
+    _kvCount++;
+    _string(_kv, key);
+    _u32(_kv, 8);
+    _string(_kv, value);
+  }
+
+  void addInt32Array(String key, List<int> values) {
+    _kvCount++;
+    _string(_kv, key);
+    _u32(_kv, 9);
+    _u32(_kv, 5);
+    _u64(_kv, values.length);
+    for (final value in values) {
+      _u32(_kv, value);
+    }
+  }
+
+  void addStringArray(String key, List<String> values) {
+    _kvCount++;
+    _string(_kv, key);
+    _u32(_kv, 9);
+    _u32(_kv, 8);
+    _u64(_kv, values.length);
+    for (final value in values) {
+      _string(_kv, value);
+    }
+  }
+
+  Uint8List build() {
+    _u32(_bytes, 0x46554747);
+    _u32(_bytes, 3);
+    _u64(_bytes, 0);
+    _u64(_bytes, _kvCount);
+    _bytes.add(_kv.takeBytes());
+    return _bytes.takeBytes();
+  }
+}
+
+Uint8List _makeModel() {
+  final writer = _GGUFWriter();
+  writer.addString("general.architecture", "llama");
+  // Longer than the read buffer of the parser.
+  writer.addString("general.description", "d" * 100000);
+  writer.addUint32("llama.block_count", 3);
+  writer.addUint32("llama.embedding_length", 64);
+  writer.addUint32("llama.attention.head_count", 8);
+  writer.addInt32Array("llama.attention.head_count_kv", [8, 2, 4]);
+  writer.addUint32("llama.context_length", 2048);
+  writer.addStringArray(
+      "tokenizer.ggml.tokens", ["a", "b", "t" * 70000, "c", "d"]);
+  return writer.build();
+}
+
+void main() {
+  late Directory dir;
+
+  setUp(() {
+    dir = Directory.systemTemp.createTempSync("ailia_llm_test");
+  });
+
+  tearDown(() {
+    dir.deleteSync(recursive: true);
+  });
+
+  test('read a GGUF header with per-layer head_count_kv', () {
+    final Uint8List data = _makeModel();
+    final String path = "${dir.path}/model.gguf";
+    File(path).writeAsBytesSync(data);
+
+    final AiliaLLMModelInfo info = AiliaLLMModelInfo.read(path);
+    expect(info.fileSize, data.length);
+    expect(info.contextLength, 2048);
+    expect(info.nVocab, 5);
+    expect(info.nHead, 8);
+    // (8 + 2 + 4) heads * (8 + 8) key and value elements.
+    expect(info.kvElementsPerToken, 224);
+    expect(info.estimate(0).nCtx, 2048);
+    expect(info.estimate(1024).kvCache, 224 * 2 * 1024);
+  });
+
+  test('read a truncated GGUF header', () {
+    final Uint8List data = _makeModel();
+    final String path = "${dir.path}/model.gguf";
+    File(path).writeAsBytesSync(Uint8List.sublistView(data, 0, 50000));
+
+    expect(() => AiliaLLMModelInfo.read(path), throwsException);
+  });
+
+  test('read a file which is not GGUF', () {
+    final String path = "${dir.path}/model.gguf";
+    File(path).writeAsBytesSync(List<int>.filled(64, 0));
+
+    expect(() => AiliaLLMModelInfo.read(path), throwsException);
+  });
+
+  group('fitContextLength', () {
+    final info = AiliaLLMModelInfo(1000, 4096, 10, 1, 1);
+
+    test('fits fully', () {
+      expect(info.fitContextLength(0, info.estimate(4096).total), 4096);
+      expect(info.fitContextLength(2048, info.estimate(4096).total), 2048);
+    });
+
+    test('is rounded down to a multiple of 256', () {
+      expect(info.fitContextLength(0, info.estimate(1000).total), 768);
+    });
+
+    test('fits under 256 tokens', () {
+      expect(info.fitContextLength(0, info.estimate(100).total), 100);
+    });
+
+    test('does not fit', () {
+      expect(info.fitContextLength(0, 500), 0);
+    });
+  });
+}
@@ -0,0 +1,65 @@
+import 'dart:convert';
+
+import 'package:flutter_test/flutter_test.dart';
+import 'package:ailia_llm/ailia_llm_utf8.dart';
+
+// Decode bytes split into tokens at the given offsets.
+List<String> _decode(List<int> bytes, List<int> splits) {
+  final decoder = AiliaLLMUtf8Decoder();
+  final List<String> deltas = List<String>.empty(growable: true);
+  int start = 0;
+  for (final int end in [...splits, bytes.length]) {
+    deltas.add(decoder.convert(bytes.sublist(start, end)));
+    start = end;
+  }
+  return deltas;
+}
+
+void main() {
+  test('characters split across tokens', () {
+    for (final String character in ["é", "あ", "😀"]) {
+      final List<int> bytes = utf8.encode("a${character}b");
+      for (int split = 2; split < bytes.length - 1; split++) {
+        final List<String> deltas = _decode(bytes, [split]);
+        expect(deltas, ["a", "${character}b"],
+            reason: "$character split at $split");
+      }
+    }
+  });
+
+  test('character split into one byte tokens', () {
+    final List<int> bytes = utf8.encode("😀");
+    expect(_decode(bytes, [1, 2, 3]), ["", "", "", "😀"]);
+  });
+
+  test('pending bytes are dropped by reset', () {
+    final decoder = AiliaLLMUtf8Decoder();
+    expect(decoder.convert([0xE3, 0x81]), "");
+    expect(decoder.pendingLength, 2);
+    decoder.reset();
+    expect(decoder.pendingLength, 0);
+    expect(decoder.convert(utf8.encode("b")), "b");
+  });
+
+  test('invalid lead bytes', () {
+    expect(_decode([0x61, 0xFF, 0x62], []), ["a\uFFFDb"]);
+    expect(_decode([0x61, 0xFF], []), ["a\uFFFD"]);
+    expect(_decode([0x80, 0x61], []), ["\uFFFDa"]);
+  });
+
+  test('incomplete character followed by another character', () {
+    expect(_decode([0xE3, 0x81, 0x61], [2]), ["", "\uFFFDa"]);
+  });
+
+  test('completeLength', () {
+    expect(AiliaLLMUtf8Decoder.completeLength(utf8.encode("aé")), 3);
+    expect(
+        AiliaLLMUtf8Decoder.completeLength(
+            utf8.encode("aあ").sublist(0, 3)),
+        1);
+    expect(
+        AiliaLLMUtf8Decoder.completeLength(
+            utf8.encode("a😀").sublist(0, 4)),
+        1);
+  });
+}